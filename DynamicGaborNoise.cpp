@@ -8,20 +8,20 @@
  */
 
 #include "DynamicGaborNoise.h"
+#include "GaborNoiseMovie.h"
 
 #include <algorithm>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
 #include <boost/math/special_functions/round.hpp>
 
 #define BUFFER_OFFSET(offset) ((void *)(offset))
-#ifndef M_PI
-#  define M_PI 3.14159265358979323846
-#endif
 
 #define PROGRAM_NAME "Dynamic_Gabor_Noise"
 
-const float gabor_noise_truncate = 0.01; // the value of the Gaussian at which the noise Gabor is truncated
-
 
 const std::string DynamicGaborNoise::HORIZONTALRESOLUTION("horizontalResolution");
 const std::string DynamicGaborNoise::VERTICALRESOLUTION("verticalResolution");
@@ -42,6 +42,13 @@ const std::string DynamicGaborNoise::SPATIALFREQUENCY("spatialFrequency");
 const std::string DynamicGaborNoise::PHASEOFFSET("phaseOffset");
 const std::string DynamicGaborNoise::CONTRAST("contrast");
 const std::string DynamicGaborNoise::TRANSPARENCY("transparency");
+const std::string DynamicGaborNoise::CONTRAST_TIMELINE("contrastTimeline");
+const std::string DynamicGaborNoise::TRANSPARENCY_TIMELINE("transparencyTimeline");
+const std::string DynamicGaborNoise::NOISE_TIMESPEEDUP_TIMELINE("noise_timeSpeedUpTimeline");
+const std::string DynamicGaborNoise::TIMELINE_SAMPLERATE("timelineSampleRate");
+const std::string DynamicGaborNoise::NOISE_MOVIE("noiseMovie");
+const std::string DynamicGaborNoise::NOISE_MOVIE_FRAMESAHEAD("noiseMovieFramesAhead");
+const std::string DynamicGaborNoise::NOISE_MOVIE_VERIFYHASH("noiseMovieVerifyHash");
 
 
 
@@ -71,6 +78,13 @@ void DynamicGaborNoise::describeComponent(ComponentInfo &info) {
     info.addParameter(PHASEOFFSET, "0.0");
     info.addParameter(CONTRAST, "1.0");
     info.addParameter(TRANSPARENCY, "1.0");
+    info.addParameter(CONTRAST_TIMELINE, false);
+    info.addParameter(TRANSPARENCY_TIMELINE, false);
+    info.addParameter(NOISE_TIMESPEEDUP_TIMELINE, false);
+    info.addParameter(TIMELINE_SAMPLERATE, "60.0");
+    info.addParameter(NOISE_MOVIE, false);
+    info.addParameter(NOISE_MOVIE_FRAMESAHEAD, "3");
+    info.addParameter(NOISE_MOVIE_VERIFYHASH, "1");
 }
 
 
@@ -95,14 +109,28 @@ StandardDynamicStimulus(parameters),
     phaseOffset(registerVariable(parameters[PHASEOFFSET])),
     contrast(registerVariable(parameters[CONTRAST])),
     transparency(registerVariable(parameters[TRANSPARENCY])),
+    timelineSampleRate(registerVariable(parameters[TIMELINE_SAMPLERATE])),
+    noiseMovieFramesAhead(registerVariable(parameters[NOISE_MOVIE_FRAMESAHEAD])),
+    noiseMovieVerifyHash(registerVariable(parameters[NOISE_MOVIE_VERIFYHASH])),
+    timelineTexture(0),
+    contrastOnTimeline(false),
+    transparencyOnTimeline(false),
+    timeSpeedUpOnTimeline(false),
+    timelineNeedsUpload(true),
+    timelineAnnounced(false),
+    timelineSampleRateValue(0),
+    maxTextureSize(0),
+    noiseMovieFramesAheadValue(0),
+    noiseMovieNeedsBegin(true),
+    noiseMovieAnnounced(false),
+    noiseMovieTexture(0),
+    noiseMovieFrame(-1),
     previousTime(-1),
-    currentTime(-1)
+    currentTime(-1),
+    elapsedTime(0)
 {
     
-    double halfScreenVisualDeg = 180.0 * std::atan((horizontalScreenSize->getValue().getFloat() / 2.0) / viewingDistance->getValue().getFloat()) / M_PI;
-    double pixelsPerDeg = (horizontalResolution->getValue().getFloat() / 2.0) / halfScreenVisualDeg;
-    gabor_noise_frequency = noise_spatialFrequency->getValue().getFloat() / pixelsPerDeg;
-    gabor_noise_bandWidth = noise_bandWidth->getValue().getFloat() / pixelsPerDeg;
+    double pixelsPerDeg = noise_geometry().pixelsPerDeg;
     detection_Gabor_XLocation = textureSize->getValue().getFloat() / 2.0 + azimuth->getValue().getFloat() * pixelsPerDeg;
     detection_Gabor_YLocation = textureSize->getValue().getFloat() / 2.0 + elevation->getValue().getFloat() * pixelsPerDeg;
     detection_Gabor_Frequency = spatialFrequency->getValue().getFloat() / pixelsPerDeg;
@@ -110,7 +138,42 @@ StandardDynamicStimulus(parameters),
     detection_Gabor_Orientation = (orientation->getValue().getFloat() / 180.0) * M_PI + M_PI / 2.0;
     detection_Gabor_Offset = (phaseOffset->getValue().getFloat() / 180.0) * M_PI;
     
+    // The timelines are optional: without them the values are read from their variables every frame
+    
+    if (!parameters[CONTRAST_TIMELINE].empty()) {
+        contrastTimeline = registerVariable(parameters[CONTRAST_TIMELINE]);
+    }
+    if (!parameters[TRANSPARENCY_TIMELINE].empty()) {
+        transparencyTimeline = registerVariable(parameters[TRANSPARENCY_TIMELINE]);
+    }
+    if (!parameters[NOISE_TIMESPEEDUP_TIMELINE].empty()) {
+        noise_timeSpeedUpTimeline = registerVariable(parameters[NOISE_TIMESPEEDUP_TIMELINE]);
+    }
+    
+    // With a precomputed noise movie the noise is streamed from the file instead of computed by the shader
+    
+    if (!parameters[NOISE_MOVIE].empty()) {
+        noiseMoviePath = pathFromParameterValue(parameters[NOISE_MOVIE]).string();
+        try {
+            noiseMovie.reset(new GaborNoiseMovieFile(noiseMoviePath));
+        }
+        catch (const std::exception &e) {
+            throw SimpleException(e.what());
+        }
+    }
+    
     validateParameters();
+    
+    // Hashing reads the whole file, so it is only done once the header has passed the checks above
+    
+    if (noiseMovie && noiseMovieVerifyHash->getValue().getBool()) {
+        try {
+            noiseMovie->verifyHash();
+        }
+        catch (const std::exception &e) {
+            throw SimpleException(e.what());
+        }
+    }
 }
 
 
@@ -125,6 +188,7 @@ void DynamicGaborNoise::load(shared_ptr<StimulusDisplay> display) {
 
 
     init();
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize); // limits the timeline length, checked in timeline_read
     //}
     
     loaded = true;
@@ -265,16 +329,12 @@ uint DynamicGaborNoise::getSeed()
 };
 
 
-class pseudo_random_number_generator {
-private:
-    GLuint seed_;
-public:
-    void seed(GLuint s) { seed_ = s; }
-    GLuint changeSeed () {seed_ *= 3039177861u; return seed_; }
-    GLfloat uniform_0_1 () {return GLfloat(changeSeed()) / GLfloat(UINT_MAX); }
-    GLfloat uniform (GLfloat min, GLfloat max) { return min + (uniform_0_1() * (max - min)); }
-    GLfloat gaussian_rv (GLfloat mean, GLfloat variance) {GLfloat x_1 = uniform_0_1(); GLfloat x_2 = uniform_0_1(); GLfloat z = sqrt(-2.0 * log(x_1)) * cos(2.0 * M_PI * x_2); return mean + (sqrt(variance) * z); } // Box-Muller transformation
-};
+GaborNoiseGeometry DynamicGaborNoise::noise_geometry() const
+{
+    return gabor_noise_geometry(horizontalResolution->getValue().getFloat(), viewingDistance->getValue().getFloat(), horizontalScreenSize->getValue().getFloat(),
+                                textureSize->getValue().getInteger(), noise_nImpulses->getValue().getInteger(),
+                                noise_spatialFrequency->getValue().getFloat(), noise_bandWidth->getValue().getFloat());
+}
 
 
 void DynamicGaborNoise::gabor_noise_begin()
@@ -291,43 +351,18 @@ void DynamicGaborNoise::gabor_noise_begin()
     unsigned gabor_noise_impulses = noise_nImpulses->getValue().getInteger();
     
     
-    gabor_noise_2d_f[0]   = gabor_noise_frequency * std::cos(gabor_noise_orientation_theta);
-    gabor_noise_2d_f[1]   = gabor_noise_frequency * std::sin(gabor_noise_orientation_theta);
-    gabor_noise_2d_a      = gabor_noise_bandWidth;
-    gabor_noise_2d_r      = std::sqrt(-log(gabor_noise_truncate) / M_PI) / gabor_noise_2d_a;
-    gabor_noise_2d_lambda = noise_nImpulses->getValue().getFloat() / (M_PI * (gabor_noise_2d_r * gabor_noise_2d_r));
+    GaborNoiseGeometry noise = noise_geometry();
+    gabor_noise_2d_f[0]   = noise.f * std::cos(gabor_noise_orientation_theta);
+    gabor_noise_2d_f[1]   = noise.f * std::sin(gabor_noise_orientation_theta);
+    gabor_noise_2d_a      = noise.a;
+    gabor_noise_2d_r      = noise.r;
+    gabor_noise_2d_lambda = noise.lambda;
     
     // Compute the random variables that will be stored in the uniform block
     
-    enum uniformBlocks { Gabor_X_Indices, Gabor_Y_Indices, Gabor_Orientations, Gabor_PhaseJitter, NumUniformBlocks};
-    GLuint gabor_noise_gridSize = ceil(textureSize->getValue().getInteger() / gabor_noise_2d_r) + 2;
-    int nArrayElements = gabor_noise_gridSize * gabor_noise_gridSize * gabor_noise_impulses * NumUniformBlocks;
-    int nImpulses = gabor_noise_gridSize * gabor_noise_gridSize * gabor_noise_impulses;
-    GLfloat gabor_impulseParams[nArrayElements];
-    
-    pseudo_random_number_generator prng;
-    uint gabor_noise_seed = getSeed();
-    prng.seed(gabor_noise_seed);
-    int iter = 0;
-    for (int imp = 0; imp < nImpulses; imp++) {
-        for (int pn = 0; pn < NumUniformBlocks; pn++) {
-            switch (pn) {
-                case Gabor_X_Indices:
-                    gabor_impulseParams[iter] = prng.uniform_0_1();
-                    break;
-                case Gabor_Y_Indices:
-                    gabor_impulseParams[iter] = prng.uniform_0_1();
-                    break;
-                case Gabor_Orientations:
-                    gabor_impulseParams[iter] = prng.uniform(0.0, 2.0 * M_PI);
-                    break;
-                case Gabor_PhaseJitter:
-                    gabor_impulseParams[iter] = prng.gaussian_rv(0.0, noise_timeSpeedUpSigma->getValue().getFloat());
-                    break;
-            }
-            iter++;
-        }
-    }
+    GLuint gabor_noise_gridSize = noise.gridSize;
+    std::vector<GLfloat> gabor_impulseParams;
+    gabor_noise_impulse_params(getSeed(), gabor_noise_gridSize, gabor_noise_impulses, noise_timeSpeedUpSigma->getValue().getFloat(), gabor_impulseParams);
     
     // Set up the uniform buffer and variables
     
@@ -338,7 +373,8 @@ void DynamicGaborNoise::gabor_noise_begin()
     GLuint blockIndex = glGetUniformBlockIndex(gabor_noise_program, "ImpulseParam");
     glGetActiveUniformBlockiv(gabor_noise_program,blockIndex,GL_UNIFORM_BLOCK_DATA_SIZE, &blockSize);
     glUniformBlockBinding(gabor_noise_program, blockIndex, blockBinding);
-    glBufferData(GL_UNIFORM_BUFFER, blockSize, gabor_impulseParams, GL_DYNAMIC_DRAW);
+    gabor_impulseParams.resize(std::max(gabor_impulseParams.size(), std::size_t(blockSize) / sizeof(GLfloat)));
+    glBufferData(GL_UNIFORM_BUFFER, blockSize, &gabor_impulseParams[0], GL_DYNAMIC_DRAW);
     glBindBufferBase(GL_UNIFORM_BUFFER, blockBinding, uniformBuffer);
     
     uniformTimeLocation = glGetUniformLocation(gabor_noise_program, "gabor_noise_2d_time");
@@ -363,6 +399,258 @@ void DynamicGaborNoise::gabor_noise_begin()
 }
 
 
+void DynamicGaborNoise::read_timeline(shared_ptr<Variable> variable, std::vector<GLfloat> &samples)
+{
+    samples.clear();
+    if (!variable)
+        return;
+    
+    Datum value = variable->getValue();
+    if (value.isList()) {
+        for (int i = 0; i < value.getNElements(); i++) {
+            samples.push_back(value.getElement(i).getFloat());
+        }
+    }
+    else {
+        samples.push_back(value.getFloat());
+    }
+}
+
+
+GLfloat DynamicGaborNoise::timeline_value(const std::vector<GLfloat> &samples, double time) const
+{
+    // Same linear interpolation between samples as the texture lookup in the shader
+    double position = std::max(time * timelineSampleRateValue, 0.0);
+    std::size_t index = std::min(std::size_t(position), samples.size() - 1);
+    if (index + 1 >= samples.size())
+        return samples.back();
+    double fraction = position - index;
+    return (1.0 - fraction) * samples[index] + fraction * samples[index + 1];
+}
+
+
+void DynamicGaborNoise::timeline_read()
+{
+    // Every timeline holds one value per sample (at timelineSampleRate), the shader interpolates linearly between samples
+    // and holds the last value once the timeline has run out. The lists are read once per trial, so drawFrame no longer
+    // needs to read these variables. Everything is validated before any state is changed, so a rejected timeline
+    // leaves the previous trial's intact.
+    
+    std::vector<GLfloat> newContrastSamples, newTransparencySamples, newTimeSpeedUpSamples;
+    read_timeline(contrastTimeline, newContrastSamples);
+    read_timeline(transparencyTimeline, newTransparencySamples);
+    read_timeline(noise_timeSpeedUpTimeline, newTimeSpeedUpSamples);
+    
+    GLfloat newSampleRate = timelineSampleRate->getValue().getFloat();
+    if (!newContrastSamples.empty() || !newTransparencySamples.empty() || !newTimeSpeedUpSamples.empty()) {
+        if (newSampleRate <= 0.0f) {
+            throw SimpleException("timelineSampleRate must be positive");
+        }
+        std::size_t nSamples = std::max(newContrastSamples.size(), std::max(newTransparencySamples.size(), newTimeSpeedUpSamples.size()));
+        if (nSamples > std::size_t(maxTextureSize)) {
+            throw SimpleException("timeline has more samples than the maximum texture size");
+        }
+        for (std::size_t i = 0; i < newContrastSamples.size(); i++) {
+            if (newContrastSamples[i] < 0.0f || newContrastSamples[i] > 1.0f) {
+                throw SimpleException("contrastTimeline values must be within [0,1]");
+            }
+        }
+    }
+    
+    contrastSamples.swap(newContrastSamples);
+    transparencySamples.swap(newTransparencySamples);
+    timeSpeedUpSamples.swap(newTimeSpeedUpSamples);
+    contrastOnTimeline      = !contrastSamples.empty();
+    transparencyOnTimeline  = !transparencySamples.empty();
+    timeSpeedUpOnTimeline   = !timeSpeedUpSamples.empty();
+    timelineSampleRateValue = newSampleRate;
+}
+
+
+void DynamicGaborNoise::timeline_upload()
+{
+    // Called with the program bound on the first frame of a trial, after timeline_read
+    
+    timelineElapsedTimeLocation = glGetUniformLocation(gabor_noise_program, "timeline_elapsedTime");
+    glUniform1i(glGetUniformLocation(gabor_noise_program, "timeline"), 0);
+    glUniform4f(glGetUniformLocation(gabor_noise_program, "timeline_mask"), contrastOnTimeline, transparencyOnTimeline, timeSpeedUpOnTimeline, timeSpeedUpOnTimeline);
+    
+    if (!contrastOnTimeline && !transparencyOnTimeline && !timeSpeedUpOnTimeline)
+        return;
+    
+    std::size_t nSamples = std::max(contrastSamples.size(), std::max(transparencySamples.size(), timeSpeedUpSamples.size()));
+    
+    // RGBA = contrast, transparency, noise time speed-up, noise time. The noise time is the integral of the speed-up,
+    // so that the noise phase stays continuous when the speed changes.
+    
+    enum timelineChannels { Timeline_Contrast, Timeline_Transparency, Timeline_TimeSpeedUp, Timeline_Time, NumTimelineChannels };
+    std::vector<GLfloat> timeline(nSamples * NumTimelineChannels, 0.0f);
+    for (std::size_t i = 0; i < nSamples; i++) {
+        GLfloat *sample = &timeline[i * NumTimelineChannels];
+        if (contrastOnTimeline) {
+            sample[Timeline_Contrast] = contrastSamples[std::min(i, contrastSamples.size() - 1)];
+        }
+        if (transparencyOnTimeline) {
+            sample[Timeline_Transparency] = transparencySamples[std::min(i, transparencySamples.size() - 1)];
+        }
+        if (timeSpeedUpOnTimeline) {
+            sample[Timeline_TimeSpeedUp] = timeSpeedUpSamples[std::min(i, timeSpeedUpSamples.size() - 1)];
+            if (i > 0) {
+                const GLfloat *previous = &timeline[(i - 1) * NumTimelineChannels];
+                sample[Timeline_Time] = previous[Timeline_Time] + 0.5 * (previous[Timeline_TimeSpeedUp] + sample[Timeline_TimeSpeedUp]) / (timelineSampleRateValue * 60.0);
+            }
+        }
+    }
+    
+    if (timelineTexture == 0) {
+        glGenTextures(1, &timelineTexture);
+    }
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_1D, timelineTexture);
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA32F, nSamples, 0, GL_RGBA, GL_FLOAT, &timeline[0]);
+    
+    glUniform1f(glGetUniformLocation(gabor_noise_program, "timeline_nSamples"), nSamples);
+    glUniform1f(glGetUniformLocation(gabor_noise_program, "timeline_sampleRate"), timelineSampleRateValue);
+}
+
+
+void DynamicGaborNoise::noise_movie_begin()
+{
+    // Called with the program bound on the first frame of a trial. The movie frame is drawn from its own texture on unit 1 (unit 0 holds the timeline). The sampler is set even
+    // without a movie, because samplers of different types may not share a unit.
+    
+    glUniform1i(glGetUniformLocation(gabor_noise_program, "noise_movie"), 1);
+    glUniform1i(glGetUniformLocation(gabor_noise_program, "noise_movie_enabled"), bool(noiseMovie));
+    if (!noiseMovie)
+        return;
+    
+    // Frames are copied from the mapped file into a ring of mapped pixel buffers by a worker thread
+    // (GaborNoiseMovieLoader), ahead of the frame that shows them. drawFrame only unmaps a filled buffer and
+    // issues the asynchronous texture upload from it. The ring holds the frame shown plus noiseMovieFramesAhead
+    // queued ones.
+    
+    const GaborNoiseMovieHeader &header = noiseMovie->header();
+    GLenum type = (header.bitsPerPixel == 16) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE;
+    
+    if (noiseMovieTexture == 0) {
+        glGenTextures(1, &noiseMovieTexture);
+    }
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, noiseMovieTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, (header.bitsPerPixel == 16) ? GL_R16 : GL_R8, header.textureSize, header.textureSize, 0, GL_RED, type, NULL);
+    glActiveTexture(GL_TEXTURE0);
+    
+    if (!noiseMovieLoader) {
+        noiseMovieLoader.reset(new GaborNoiseMovieLoader(*noiseMovie));
+    }
+    
+    std::size_t nBuffers = noiseMovieFramesAheadValue + 1;
+    if (noiseMovieBuffers.size() != nBuffers) {
+        for (std::size_t buffer = 0; buffer < noiseMovieBuffers.size(); buffer++) {
+            noise_movie_finish(buffer);
+        }
+        if (!noiseMovieBuffers.empty()) {
+            glDeleteBuffers(noiseMovieBuffers.size(), &noiseMovieBuffers[0]);
+        }
+        noiseMovieBuffers.resize(nBuffers);
+        glGenBuffers(nBuffers, &noiseMovieBuffers[0]);
+        for (std::size_t buffer = 0; buffer < nBuffers; buffer++) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, noiseMovieBuffers[buffer]);
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, header.frameSize(), NULL, GL_STREAM_DRAW);
+        }
+        noiseMovieBufferFrames.assign(nBuffers, -1);
+        noiseMovieBufferPointers.assign(nBuffers, (void *)NULL);
+    }
+    noiseMovieFrame = -1;
+    
+    for (std::size_t frame = 0; frame < nBuffers && frame < header.nFrames; frame++) {
+        if (noiseMovieBufferFrames[frame] != long(frame)) {
+            noise_movie_queue(frame, frame);
+        }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+
+void DynamicGaborNoise::noise_movie_queue(std::size_t buffer, long frame)
+{
+    // Maps the buffer and hands it to the loader thread. Invalidating the buffer orphans its previous contents,
+    // so this never waits for an upload that still reads from it.
+    
+    noise_movie_finish(buffer);
+    std::size_t frameSize = noiseMovie->header().frameSize();
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, noiseMovieBuffers[buffer]);
+    void *pixels = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, frameSize, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (pixels == NULL) {
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, frameSize, noiseMovie->frame(frame), GL_STREAM_DRAW); // copy on this thread instead
+    }
+    else {
+        noiseMovieLoader->request(buffer, frame, pixels);
+    }
+    noiseMovieBufferPointers[buffer] = pixels;
+    noiseMovieBufferFrames[buffer] = frame;
+}
+
+
+void DynamicGaborNoise::noise_movie_finish(std::size_t buffer)
+{
+    // Waits for the loader to fill the buffer (normally long done) and unmaps it, so GL can read from it
+    
+    if (noiseMovieBufferPointers[buffer] == NULL)
+        return;
+    noiseMovieLoader->wait(buffer);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, noiseMovieBuffers[buffer]);
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    noiseMovieBufferPointers[buffer] = NULL;
+}
+
+
+void DynamicGaborNoise::noise_movie_update(double time)
+{
+    // Rounded to the nearest frame, so that timing jitter around a frame boundary does not repeat or skip frames
+    // when the movie runs at the display's refresh rate. The last frame is held once the movie has run out.
+    
+    const GaborNoiseMovieHeader &header = noiseMovie->header();
+    long frame = std::min(long(std::floor(time * header.frameRate + 0.5)), long(header.nFrames) - 1);
+    
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, noiseMovieTexture);
+    
+    if (frame != noiseMovieFrame) {
+        std::size_t nBuffers = noiseMovieBuffers.size();
+        std::size_t buffer = frame % nBuffers;
+        if (noiseMovieBufferFrames[buffer] != frame) {
+            noise_movie_queue(buffer, frame); // dropped frames or a new trial: this one was not queued yet
+        }
+        noise_movie_finish(buffer);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, noiseMovieBuffers[buffer]);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, header.textureSize, header.textureSize, GL_RED,
+                        (header.bitsPerPixel == 16) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE, BUFFER_OFFSET(0));
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        
+        // Queue the following frames in the other buffers
+        
+        for (long next = frame + 1; next < frame + long(nBuffers) && next < long(header.nFrames); next++) {
+            if (noiseMovieBufferFrames[next % nBuffers] != next) {
+                noise_movie_queue(next % nBuffers, next);
+            }
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        noiseMovieFrame = frame;
+    }
+    
+    glActiveTexture(GL_TEXTURE0);
+}
+
+
 void DynamicGaborNoise::init()
 {
     
@@ -405,11 +693,42 @@ void DynamicGaborNoise::init()
 
 
 
+static void check_noise_movie_parameter(const std::string &name, shared_ptr<Variable> variable, float movieValue)
+{
+    // The header stores the parameters as floats, so compare at that precision
+    if (GLfloat(variable->getValue().getFloat()) != movieValue) {
+        throw SimpleException("noiseMovie was rendered with a different " + name);
+    }
+}
+
+
 void DynamicGaborNoise::validateParameters() const {
     if (contrast->getValue().getFloat() < 0.0f || contrast->getValue().getFloat() > 1.0f) {
         throw SimpleException("contrast must be within [0,1]");
     }
     
+    if (noiseMovie) {
+        const GaborNoiseMovieHeader &header = noiseMovie->header();
+        if (noise_timeSpeedUpTimeline) {
+            throw SimpleException("noise_timeSpeedUpTimeline cannot be used with noiseMovie, whose noise time course is fixed");
+        }
+        if (noiseMovieFramesAhead->getValue().getInteger() < 1) {
+            throw SimpleException("noiseMovieFramesAhead must be at least 1");
+        }
+        if (header.textureSize != GLuint(textureSize->getValue().getInteger())) {
+            throw SimpleException("noiseMovie was rendered for a different textureSize");
+        }
+        check_noise_movie_parameter(HORIZONTALRESOLUTION, horizontalResolution, header.horizontalResolution);
+        check_noise_movie_parameter(VIEWINGDISTANCE, viewingDistance, header.viewingDistance);
+        check_noise_movie_parameter(HORIZONTALSCREENSIZE, horizontalScreenSize, header.horizontalScreenSize);
+        check_noise_movie_parameter(NOISE_NIMPULSES, noise_nImpulses, header.noise_nImpulses);
+        check_noise_movie_parameter(NOISE_SPATIALFREQUENCY, noise_spatialFrequency, header.noise_spatialFrequency);
+        check_noise_movie_parameter(NOISE_BANDWIDTH, noise_bandWidth, header.noise_bandWidth);
+        check_noise_movie_parameter(NOISE_TIMESPEEDUP, noise_timeSpeedUp, header.noise_timeSpeedUp);
+        check_noise_movie_parameter(NOISE_TIMESPEEDUPSIGMA, noise_timeSpeedUpSigma, header.noise_timeSpeedUpSigma);
+        check_noise_movie_parameter(NOISE_CONTRAST, noise_contrast, header.noise_contrast);
+    }
+    
     // make one for the maximum number of impulses
 
 }
@@ -441,13 +760,40 @@ void DynamicGaborNoise::drawFrame(shared_ptr<StimulusDisplay> display) {
         previousTime = currentTime;
     }*/
     
-    currentTime = double(getElapsedTime()) / 1000000.0; // in seconds
-    double gabor_noise_2d_time = noise_timeSpeedUp->getValue().getFloat() * (currentTime/60.0);
-    glUniform1f(uniformTimeLocation, gabor_noise_2d_time);
+    currentTime = getElapsedTime();
+    elapsedTime = double(currentTime) / 1000000.0; // in seconds
+    
+    if (timelineNeedsUpload) {
+        glUseProgram(gabor_noise_program);
+        timeline_upload();
+        timelineNeedsUpload = false;
+    }
+    if (noiseMovieNeedsBegin) {
+        glUseProgram(gabor_noise_program);
+        noise_movie_begin();
+        noiseMovieNeedsBegin = false;
+    }
+    glUniform1f(timelineElapsedTimeLocation, elapsedTime);
+    if (timelineTexture != 0) {
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_1D, timelineTexture);
+    }
+    
+    // Values on a timeline are looked up by the shader, only the others are read from their variables
+    
+    if (noiseMovie) {
+        noise_movie_update(elapsedTime);
+    }
+    else if (!timeSpeedUpOnTimeline) {
+        double gabor_noise_2d_time = noise_timeSpeedUp->getValue().getFloat() * (elapsedTime/60.0);
+        glUniform1f(uniformTimeLocation, gabor_noise_2d_time);
+    }
     
     //if (frame == detection_Gabor_onsetFrame) {
-        glUniform1f(transparencyLocation, transparency->getValue().getFloat());
-        glUniform1f(contrastLocation, contrast->getValue().getFloat());
+        if (!transparencyOnTimeline)
+            glUniform1f(transparencyLocation, transparency->getValue().getFloat());
+        if (!contrastOnTimeline)
+            glUniform1f(contrastLocation, contrast->getValue().getFloat());
     //}
     
     glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
@@ -467,34 +813,112 @@ void DynamicGaborNoise::drawFrame(shared_ptr<StimulusDisplay> display) {
 }
 
 
+static Datum timeline_datum(const std::vector<GLfloat> &samples)
+{
+    Datum list(M_LIST, int(samples.size()));
+    for (std::size_t i = 0; i < samples.size(); i++) {
+        list.setElement(i, Datum(double(samples[i])));
+    }
+    return list;
+}
+
+
 Datum DynamicGaborNoise::getCurrentAnnounceDrawData() {
     boost::mutex::scoped_lock locker(stim_lock);
 
     Datum announceData = StandardDynamicStimulus::getCurrentAnnounceDrawData();
 
     announceData.addElement(STIM_TYPE, "dynamic_gabor_noise");
-    announceData.addElement(HORIZONTALRESOLUTION, horizontalResolution->getValue().getInteger());
-    announceData.addElement(VERTICALRESOLUTION, verticalResolution->getValue().getInteger());
-    announceData.addElement(VIEWINGDISTANCE, viewingDistance->getValue().getInteger());
-    announceData.addElement(TEXTURESIZE, textureSize->getValue().getInteger());
-    announceData.addElement(NOISE_NIMPULSES, noise_nImpulses->getValue().getInteger());
-    announceData.addElement(NOISE_SPATIALFREQUENCY, noise_spatialFrequency->getValue().getFloat());
-    announceData.addElement(NOISE_BANDWIDTH, noise_bandWidth->getValue().getFloat());
-    announceData.addElement(NOISE_TIMESPEEDUP, noise_timeSpeedUp->getValue().getFloat());
-    announceData.addElement(NOISE_TIMESPEEDUPSIGMA, noise_timeSpeedUpSigma->getValue().getFloat());
+    if (noiseMovie) {
+        // The noise is the one the movie was rendered with, whatever the variables hold by now
+        const GaborNoiseMovieHeader &header = noiseMovie->header();
+        announceData.addElement(HORIZONTALRESOLUTION, long(header.horizontalResolution));
+        announceData.addElement(VERTICALRESOLUTION, verticalResolution->getValue().getInteger());
+        announceData.addElement(VIEWINGDISTANCE, long(header.viewingDistance));
+        announceData.addElement(TEXTURESIZE, long(header.textureSize));
+        announceData.addElement(NOISE_NIMPULSES, long(header.noise_nImpulses));
+        announceData.addElement(NOISE_SPATIALFREQUENCY, double(header.noise_spatialFrequency));
+        announceData.addElement(NOISE_BANDWIDTH, double(header.noise_bandWidth));
+        announceData.addElement(NOISE_TIMESPEEDUP, double(header.noise_timeSpeedUp));
+        announceData.addElement(NOISE_TIMESPEEDUPSIGMA, double(header.noise_timeSpeedUpSigma));
+    }
+    else {
+        announceData.addElement(HORIZONTALRESOLUTION, horizontalResolution->getValue().getInteger());
+        announceData.addElement(VERTICALRESOLUTION, verticalResolution->getValue().getInteger());
+        announceData.addElement(VIEWINGDISTANCE, viewingDistance->getValue().getInteger());
+        announceData.addElement(TEXTURESIZE, textureSize->getValue().getInteger());
+        announceData.addElement(NOISE_NIMPULSES, noise_nImpulses->getValue().getInteger());
+        announceData.addElement(NOISE_SPATIALFREQUENCY, noise_spatialFrequency->getValue().getFloat());
+        announceData.addElement(NOISE_BANDWIDTH, noise_bandWidth->getValue().getFloat());
+        announceData.addElement(NOISE_TIMESPEEDUP, timeSpeedUpOnTimeline ? timeline_value(timeSpeedUpSamples, elapsedTime) : noise_timeSpeedUp->getValue().getFloat());
+        announceData.addElement(NOISE_TIMESPEEDUPSIGMA, noise_timeSpeedUpSigma->getValue().getFloat());
+    }
     announceData.addElement(AZIMUTH, azimuth->getValue().getFloat());
     announceData.addElement(ELEVATION, elevation->getValue().getFloat());
     announceData.addElement(SIGMA, sigma->getValue().getFloat());
     announceData.addElement(ORIENTATION, orientation->getValue().getFloat());
     announceData.addElement(SPATIALFREQUENCY, spatialFrequency->getValue().getFloat());
     announceData.addElement(PHASEOFFSET, phaseOffset->getValue().getFloat());
-    announceData.addElement(CONTRAST, contrast->getValue().getFloat());
-    announceData.addElement(TRANSPARENCY, transparency->getValue().getFloat());
+    
+    // Values on a timeline are announced as shown in the last frame; the timelines themselves only once per trial
+    
+    announceData.addElement(CONTRAST, contrastOnTimeline ? timeline_value(contrastSamples, elapsedTime) : contrast->getValue().getFloat());
+    announceData.addElement(TRANSPARENCY, transparencyOnTimeline ? timeline_value(transparencySamples, elapsedTime) : transparency->getValue().getFloat());
+    if (!timelineAnnounced && (contrastOnTimeline || transparencyOnTimeline || timeSpeedUpOnTimeline)) {
+        if (contrastOnTimeline)
+            announceData.addElement(CONTRAST_TIMELINE, timeline_datum(contrastSamples));
+        if (transparencyOnTimeline)
+            announceData.addElement(TRANSPARENCY_TIMELINE, timeline_datum(transparencySamples));
+        if (timeSpeedUpOnTimeline)
+            announceData.addElement(NOISE_TIMESPEEDUP_TIMELINE, timeline_datum(timeSpeedUpSamples));
+        announceData.addElement(TIMELINE_SAMPLERATE, double(timelineSampleRateValue));
+        timelineAnnounced = true;
+    }
+    
+    // Like the timelines, the movie itself is announced once per trial; the frame shown with every frame
+    
+    if (noiseMovie) {
+        if (!noiseMovieAnnounced) {
+            char hash[17];
+            std::snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)noiseMovie->header().hash);
+            announceData.addElement(NOISE_MOVIE, noiseMoviePath);
+            announceData.addElement("noiseMovieHash", std::string(hash));
+            announceData.addElement("noiseMovieSeed", long(noiseMovie->header().seed));
+            noiseMovieAnnounced = true;
+        }
+        announceData.addElement("noiseMovieFrame", noiseMovieFrame);
+    }
     
     return announceData;
 }
 
 
+void DynamicGaborNoise::startPlaying() {
+    // Read and check everything before the base class starts the clock, so a rejected value does not leave the stimulus playing
+    long framesAhead = 0;
+    if (noiseMovie) {
+        framesAhead = noiseMovieFramesAhead->getValue().getInteger();
+        if (framesAhead < 1) {
+            throw SimpleException("noiseMovieFramesAhead must be at least 1");
+        }
+    }
+    timeline_read();
+    timelineNeedsUpload = true;
+    timelineAnnounced = false;
+    
+    // The movie restarts with every trial; its buffers are kept, the first drawFrame queues whatever they do not hold yet
+    noiseMovieFramesAheadValue = framesAhead;
+    noiseMovieNeedsBegin = true;
+    noiseMovieAnnounced = false;
+    noiseMovieFrame = -1;
+    if (noiseMovie) {
+        noiseMovie->prefetch(0);
+    }
+    
+    StandardDynamicStimulus::startPlaying();
+}
+
+
 void DynamicGaborNoise::stopPlaying() {
     StandardDynamicStimulus::stopPlaying();
     glBindVertexArray(0);
@@ -14,6 +14,10 @@
 using namespace mw;
 
 
+struct GaborNoiseGeometry;
+class GaborNoiseMovieFile;
+class GaborNoiseMovieLoader;
+
 class DynamicGaborNoise : public StandardDynamicStimulus {
 
 public:
@@ -46,6 +50,19 @@ public:
     static const std::string CONTRAST;
     static const std::string TRANSPARENCY;
     
+    // TIMELINE PARAMETERS (optional, uploaded once per trial)
+    
+    static const std::string CONTRAST_TIMELINE;
+    static const std::string TRANSPARENCY_TIMELINE;
+    static const std::string NOISE_TIMESPEEDUP_TIMELINE;
+    static const std::string TIMELINE_SAMPLERATE;      // in samples per second
+    
+    // PRECOMPUTED NOISE MOVIE PARAMETERS (optional, see GaborNoiseMovie.h)
+    
+    static const std::string NOISE_MOVIE;
+    static const std::string NOISE_MOVIE_FRAMESAHEAD;  // frames queued in pixel buffers ahead of the one shown, at least 1
+    static const std::string NOISE_MOVIE_VERIFYHASH;   // check the movie's hash after its parameters (reads the whole file)
+    
     static void describeComponent(ComponentInfo &info);
 
     explicit DynamicGaborNoise(const ParameterValueMap &parameters);
@@ -57,6 +74,7 @@ public:
     Datum getCurrentAnnounceDrawData() MW_OVERRIDE;
    
 protected:
+    void startPlaying() MW_OVERRIDE;
     void stopPlaying() MW_OVERRIDE;
     
 private:
@@ -70,7 +88,16 @@ private:
     void compile_shader(GLuint shader);
     void program_info_log(GLuint program);
     void link_program(GLuint program);
+    GaborNoiseGeometry noise_geometry() const;
     void gabor_noise_begin();
+    void timeline_read();
+    void timeline_upload();
+    void read_timeline(shared_ptr<Variable> variable, std::vector<GLfloat> &samples);
+    GLfloat timeline_value(const std::vector<GLfloat> &samples, double time) const;
+    void noise_movie_begin();
+    void noise_movie_queue(std::size_t buffer, long frame);
+    void noise_movie_finish(std::size_t buffer);
+    void noise_movie_update(double time);
     uint getSeed();
     void gabor_noise_end();
 
@@ -97,8 +124,15 @@ private:
     shared_ptr<Variable> phaseOffset;
     shared_ptr<Variable> contrast;
     shared_ptr<Variable> transparency;
-    GLfloat gabor_noise_frequency;
-    GLfloat gabor_noise_bandWidth;
+    shared_ptr<Variable> contrastTimeline;
+    shared_ptr<Variable> transparencyTimeline;
+    shared_ptr<Variable> noise_timeSpeedUpTimeline;
+    shared_ptr<Variable> timelineSampleRate;
+    shared_ptr<Variable> noiseMovieFramesAhead;
+    shared_ptr<Variable> noiseMovieVerifyHash;
+    shared_ptr<GaborNoiseMovieFile> noiseMovie;
+    shared_ptr<GaborNoiseMovieLoader> noiseMovieLoader;
+    std::string noiseMoviePath;
     GLfloat detection_Gabor_XLocation;
     GLfloat detection_Gabor_YLocation;
     GLfloat detection_Gabor_Frequency;
@@ -109,9 +143,30 @@ private:
     GLuint  transparencyLocation;
     GLuint  contrastLocation;
     GLuint  uniformTimeLocation;
+    GLuint  timelineElapsedTimeLocation;
+    GLuint  timelineTexture;
+    bool    contrastOnTimeline;
+    bool    transparencyOnTimeline;
+    bool    timeSpeedUpOnTimeline;
+    bool    timelineNeedsUpload;
+    bool    timelineAnnounced;
+    GLfloat timelineSampleRateValue;
+    std::vector<GLfloat> contrastSamples;
+    std::vector<GLfloat> transparencySamples;
+    std::vector<GLfloat> timeSpeedUpSamples;
+    GLint   maxTextureSize; // queried in load, while the context is current
+    long    noiseMovieFramesAheadValue;
+    bool    noiseMovieNeedsBegin;
+    bool    noiseMovieAnnounced;
+    GLuint  noiseMovieTexture;
+    std::vector<GLuint> noiseMovieBuffers;
+    std::vector<long> noiseMovieBufferFrames;
+    std::vector<void *> noiseMovieBufferPointers; // non-NULL while the buffer is mapped for the loader
+    long    noiseMovieFrame;
 
     
     MWTime previousTime, currentTime;
+    double elapsedTime; // in seconds, of the last drawn frame
     
 };
 
@@ -34,6 +34,20 @@ uniform float detection_Gabor_Offset;
 uniform float detection_Gabor_Contrast;
 uniform float detection_Gabor_Transparency;
 
+// Per-trial timeline: one RGBA sample (contrast, transparency, noise time speed-up, noise time) per 1/timeline_sampleRate s.
+// timeline_mask selects which values come from the timeline instead of their uniforms.
+
+uniform sampler1D timeline;
+uniform vec4 timeline_mask;
+uniform float timeline_nSamples;
+uniform float timeline_sampleRate;
+uniform float timeline_elapsedTime;
+
+// Precomputed noise movie: the current frame, streamed in by the application
+
+uniform bool noise_movie_enabled;
+uniform sampler2D noise_movie;
+
 
 // Uniform block
 
@@ -61,19 +75,19 @@ float gabor_noise_kernel_detect(const in float w, const in vec2 f, const in floa
     return w * g * h;
 }
 
-float detection_gabor_kernel(const in vec2 fragment, inout float detection_gabor_alpha)
+float detection_gabor_kernel(const in vec2 fragment, const in float contrast, const in float transparency, inout float detection_gabor_alpha)
 {
     vec2 x             = vec2(detection_Gabor_XLocation - fragment.x, detection_Gabor_YLocation - fragment.y);
     float sigma        = 1.0 / detection_Gabor_Sigma;
     vec2 f_i           = detection_Gabor_Frequency * vec2(cos(detection_Gabor_Orientation), sin(detection_Gabor_Orientation));
-    float kernel_value = gabor_noise_kernel_detect(detection_Gabor_Contrast, f_i, detection_Gabor_Offset, sigma, x);
+    float kernel_value = gabor_noise_kernel_detect(contrast, f_i, detection_Gabor_Offset, sigma, x);
     if (length(x) <= nGaborSigmas * detection_Gabor_Sigma + borderSize / 2.0) {
         if (length(x) > nGaborSigmas * detection_Gabor_Sigma - borderSize / 2.0) { // Use a Hanning window to taper the edges
             float borderDistance = length(x) - (nGaborSigmas * detection_Gabor_Sigma - borderSize / 2.0);
-            detection_gabor_alpha = 0.5 * (1.0 + cos(pi * borderDistance / borderSize)) * detection_Gabor_Transparency;
+            detection_gabor_alpha = 0.5 * (1.0 + cos(pi * borderDistance / borderSize)) * transparency;
         }
         else {
-            detection_gabor_alpha = detection_Gabor_Transparency;
+            detection_gabor_alpha = transparency;
         }
         return 0.5 + 0.5 * kernel_value;
     }
@@ -156,6 +170,17 @@ float gabor_noise_2d_variance(const in gabor_noise_2d this_)
     return 1.0 / (4.0 * (this_.a_ * this_.a_));
 }
 
+// -----------------------------------------------------------------------------
+
+vec4 timeline_lookup(out float noise_time)
+{
+    float sample_position = timeline_elapsedTime * timeline_sampleRate;
+    vec4 value = texture(timeline, (sample_position + 0.5) / timeline_nSamples);
+    float overrun = max(sample_position - (timeline_nSamples - 1.0), 0.0); // keep the noise moving at the last speed-up once the timeline has run out
+    noise_time = value.a + value.b * overrun / (timeline_sampleRate * 60.0);
+    return value;
+}
+
 /// ############################################################################
 
 in vec2 x_tex;
@@ -165,13 +190,27 @@ float detection_gabor_alpha;
 
 void main()
 {
-    gabor_noise_2d gabor_noise_2d_;
-    gabor_noise_2d_constructor(gabor_noise_2d_, gabor_noise_2d_r, gabor_noise_2d_a, gabor_noise_2d_f, gabor_noise_2d_lambda);
-    float noise = gabor_noise_2d_noise(gabor_noise_2d_, x_tex.xy, gabor_noise_2d_time);
-    float noise_scale = 0.5 / (3.0 * sqrt(gabor_noise_2d_variance(gabor_noise_2d_)));
-    float noise_bias = 0.5;
-    float noise_intensity = noise_bias + (noise_scale * noise);
-    float detection_gabor_intensity = detection_gabor_kernel(x_tex, detection_gabor_alpha);
+    float timeline_noise_time = 0.0;
+    vec4 timeline_value = vec4(0.0);
+    if (any(notEqual(timeline_mask, vec4(0.0)))) {
+        timeline_value = timeline_lookup(timeline_noise_time);
+    }
+    float contrast = mix(detection_Gabor_Contrast, timeline_value.r, timeline_mask.r);
+    float transparency = mix(detection_Gabor_Transparency, timeline_value.g, timeline_mask.g);
+    float time = mix(gabor_noise_2d_time, timeline_noise_time, timeline_mask.a);
+    float noise_intensity;
+    if (noise_movie_enabled) {
+        noise_intensity = texelFetch(noise_movie, ivec2(x_tex + vec2(0.5)), 0).r;
+    }
+    else {
+        gabor_noise_2d gabor_noise_2d_;
+        gabor_noise_2d_constructor(gabor_noise_2d_, gabor_noise_2d_r, gabor_noise_2d_a, gabor_noise_2d_f, gabor_noise_2d_lambda);
+        float noise = gabor_noise_2d_noise(gabor_noise_2d_, x_tex.xy, time);
+        float noise_scale = 0.5 / (3.0 * sqrt(gabor_noise_2d_variance(gabor_noise_2d_)));
+        float noise_bias = 0.5;
+        noise_intensity = noise_bias + (noise_scale * noise);
+    }
+    float detection_gabor_intensity = detection_gabor_kernel(x_tex, contrast, transparency, detection_gabor_alpha);
     fragColor = (1.0 - detection_gabor_alpha) * vec4(vec3(noise_intensity), 1.0) + detection_gabor_alpha * vec4(vec3(detection_gabor_intensity), 1.0);
 }
 
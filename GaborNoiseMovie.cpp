@@ -0,0 +1,415 @@
+/*
+ *  GaborNoiseMovie.cpp
+ *  DynamicGaborNoise
+ *
+ *  Precomputed Gabor noise movies: the file format, the CPU renderer that writes them
+ *  and the memory-mapped reader used for playback.
+ *
+ */
+
+#include "GaborNoiseMovie.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+GaborNoiseGeometry gabor_noise_geometry(float horizontalResolution, float viewingDistance, float horizontalScreenSize, unsigned textureSize,
+                                        unsigned nImpulses, float spatialFrequency, float bandWidth)
+{
+    GaborNoiseGeometry geometry;
+    double halfScreenVisualDeg = 180.0 * std::atan((horizontalScreenSize / 2.0) / viewingDistance) / M_PI;
+    geometry.pixelsPerDeg = (horizontalResolution / 2.0) / halfScreenVisualDeg;
+    geometry.f            = spatialFrequency / geometry.pixelsPerDeg;
+    geometry.a            = bandWidth / geometry.pixelsPerDeg;
+    geometry.r            = std::sqrt(-log(gabor_noise_truncate) / M_PI) / geometry.a;
+    geometry.lambda       = nImpulses / (M_PI * (geometry.r * geometry.r));
+    geometry.gridSize     = std::ceil(textureSize / geometry.r) + 2;
+    return geometry;
+}
+
+
+void gabor_noise_impulse_params(uint32_t seed, unsigned gridSize, unsigned nImpulses, float timeSpeedUpSigma, std::vector<float> &impulseParams)
+{
+    enum uniformBlocks { Gabor_X_Indices, Gabor_Y_Indices, Gabor_Orientations, Gabor_PhaseJitter, NumUniformBlocks};
+    std::size_t nTotalImpulses = std::size_t(gridSize) * gridSize * nImpulses;
+    impulseParams.resize(nTotalImpulses * NumUniformBlocks);
+
+    pseudo_random_number_generator prng;
+    prng.seed(seed);
+    std::size_t iter = 0;
+    for (std::size_t imp = 0; imp < nTotalImpulses; imp++) {
+        for (int pn = 0; pn < NumUniformBlocks; pn++) {
+            switch (pn) {
+                case Gabor_X_Indices:
+                    impulseParams[iter] = prng.uniform_0_1();
+                    break;
+                case Gabor_Y_Indices:
+                    impulseParams[iter] = prng.uniform_0_1();
+                    break;
+                case Gabor_Orientations:
+                    impulseParams[iter] = prng.uniform(0.0, 2.0 * M_PI);
+                    break;
+                case Gabor_PhaseJitter:
+                    impulseParams[iter] = prng.gaussian_rv(0.0, timeSpeedUpSigma);
+                    break;
+            }
+            iter++;
+        }
+    }
+}
+
+
+// #############################################################################
+
+static std::size_t align_to_page(std::size_t size)
+{
+    return (size + GABOR_NOISE_MOVIE_ALIGNMENT - 1) / GABOR_NOISE_MOVIE_ALIGNMENT * GABOR_NOISE_MOVIE_ALIGNMENT;
+}
+
+GaborNoiseMovieHeader::GaborNoiseMovieHeader()
+{
+    std::memset(this, 0, sizeof(*this));
+    std::memcpy(magic, GABOR_NOISE_MOVIE_MAGIC, sizeof(magic));
+    version = GABOR_NOISE_MOVIE_VERSION;
+
+    // Same defaults as DynamicGaborNoise::describeComponent
+    horizontalResolution   = 1980;
+    verticalResolution     = 1080;
+    viewingDistance        = 300;
+    horizontalScreenSize   = 477;
+    textureSize            = 800;
+    noise_nImpulses        = 5;
+    noise_spatialFrequency = 0.1;
+    noise_bandWidth        = 0.1;
+    noise_timeSpeedUp      = 0.95;
+    noise_timeSpeedUpSigma = 5;
+    noise_contrast         = 1.0;
+    azimuth                = 1.0;
+    elevation              = 1.0;
+    sigma                  = 3.0;
+    orientation            = 45.0;
+    spatialFrequency       = 0.11;
+    phaseOffset            = 0.0;
+    contrast               = 1.0;
+    transparency           = 1.0;
+
+    frameRate      = 60.0;
+    nFrames        = 60;
+    bitsPerPixel   = 8;
+    framesPerChunk = 16;
+}
+
+std::size_t GaborNoiseMovieHeader::frameSize() const
+{
+    return std::size_t(textureSize) * textureSize * (bitsPerPixel / 8);
+}
+
+std::size_t GaborNoiseMovieHeader::chunkSize() const
+{
+    return align_to_page(frameSize() * framesPerChunk);
+}
+
+std::size_t GaborNoiseMovieHeader::frameOffset(uint32_t frame) const
+{
+    return align_to_page(sizeof(GaborNoiseMovieHeader)) + (frame / framesPerChunk) * chunkSize() + (frame % framesPerChunk) * frameSize();
+}
+
+std::size_t GaborNoiseMovieHeader::fileSize() const
+{
+    std::size_t nChunks = (nFrames + framesPerChunk - 1) / framesPerChunk;
+    return align_to_page(sizeof(GaborNoiseMovieHeader)) + nChunks * chunkSize();
+}
+
+uint64_t gabor_noise_movie_hash(const unsigned char *data, std::size_t size, uint64_t hash)
+{
+    for (std::size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 1099511628211ull; // FNV-1a 64 bit prime
+    }
+    return hash;
+}
+
+static const uint64_t gabor_noise_movie_hash_basis = 14695981039346656037ull;
+
+uint64_t gabor_noise_movie_header_hash(const GaborNoiseMovieHeader &header)
+{
+    // Hash the bytes as stored (padding included), with the hash field cleared
+    unsigned char bytes[sizeof(GaborNoiseMovieHeader)];
+    std::memcpy(bytes, &header, sizeof(bytes));
+    std::memset(bytes + offsetof(GaborNoiseMovieHeader, hash), 0, sizeof(header.hash));
+    return gabor_noise_movie_hash(bytes, sizeof(bytes), gabor_noise_movie_hash_basis);
+}
+
+
+// #############################################################################
+
+GaborNoiseRenderer::GaborNoiseRenderer(const GaborNoiseMovieHeader &header) :
+    header_(header),
+    geometry_(gabor_noise_geometry(header.horizontalResolution, header.viewingDistance, header.horizontalScreenSize, header.textureSize,
+                                   header.noise_nImpulses, header.noise_spatialFrequency, header.noise_bandWidth))
+{
+    scale_ = 0.5 / (3.0 * std::sqrt(1.0 / (4.0 * (geometry_.a * geometry_.a))));
+    gabor_noise_impulse_params(header.seed, geometry_.gridSize, header.noise_nImpulses, header.noise_timeSpeedUpSigma, impulseParams_);
+}
+
+float GaborNoiseRenderer::cell(int cx, int cy, float x_c, float y_c, float time) const
+{
+    const unsigned gridSize = geometry_.gridSize;
+    const float r = geometry_.r, a = geometry_.a;
+    if (cx + 1 < 0 || cy + 1 < 0 || unsigned(cx + 1) >= gridSize || unsigned(cy + 1) >= gridSize)
+        return 0.0; // +1 because cx and cy can be -1
+
+    const unsigned n = header_.noise_nImpulses;
+    const float *impulse = &impulseParams_[(std::size_t(n) * gridSize * (cy + 1) + std::size_t(n) * (cx + 1)) * 4];
+    float sum = 0.0;
+    for (unsigned i = 0; i < n; i++, impulse += 4) {
+        float x_k = r * (x_c - impulse[0]);
+        float y_k = r * (y_c - impulse[1]);
+        float d2 = x_k * x_k + y_k * y_k;
+        if (d2 < r * r) {
+            float g = std::exp(-M_PI * (a * a) * d2);
+            float h = std::sin(2.0 * M_PI * geometry_.f * (std::cos(impulse[2]) * x_k + std::sin(impulse[2]) * y_k) + time * impulse[3]);
+            sum += header_.noise_contrast * g * h;
+        }
+    }
+    return sum;
+}
+
+float GaborNoiseRenderer::intensity(float x, float y, float time) const
+{
+    float x_g = x / geometry_.r;
+    float y_g = y / geometry_.r;
+    float int_x_g = std::floor(x_g);
+    float int_y_g = std::floor(y_g);
+    float sum = 0.0;
+    for (int j = -1; j <= +1; j++) {
+        for (int i = -1; i <= +1; i++) {
+            sum += cell(int(int_x_g) + i, int(int_y_g) + j, x_g - int_x_g - i, y_g - int_y_g - j, time);
+        }
+    }
+    return 0.5 + scale_ * (sum / std::sqrt(geometry_.lambda));
+}
+
+void GaborNoiseRenderer::renderRow(uint32_t frame, uint32_t row, unsigned char *pixels) const
+{
+    float time = header_.noise_timeSpeedUp * ((frame / header_.frameRate) / 60.0);
+    for (uint32_t x = 0; x < header_.textureSize; x++) {
+        float value = std::min(std::max(intensity(x, row, time), 0.0f), 1.0f);
+        if (header_.bitsPerPixel == 16) {
+            uint16_t pixel = uint16_t(value * 65535.0f + 0.5f);
+            std::memcpy(pixels + 2 * x, &pixel, sizeof(pixel));
+        }
+        else {
+            pixels[x] = (unsigned char)(value * 255.0f + 0.5f);
+        }
+    }
+}
+
+void GaborNoiseRenderer::renderFrame(uint32_t frame, unsigned char *pixels) const
+{
+    std::size_t rowSize = header_.frameSize() / header_.textureSize;
+    for (uint32_t row = 0; row < header_.textureSize; row++) {
+        renderRow(frame, row, pixels + row * rowSize);
+    }
+}
+
+
+// #############################################################################
+
+static void render_rows(const GaborNoiseRenderer *renderer, const GaborNoiseMovieHeader *header, uint32_t firstFrame, uint32_t nFrames, unsigned thread, unsigned nThreads, unsigned char *chunk)
+{
+    // Rows of all frames in the chunk are interleaved over the threads
+    std::size_t rowSize = header->frameSize() / header->textureSize;
+    std::size_t nRows = std::size_t(nFrames) * header->textureSize;
+    for (std::size_t i = thread; i < nRows; i += nThreads) {
+        uint32_t frame = i / header->textureSize;
+        uint32_t row = i % header->textureSize;
+        renderer->renderRow(firstFrame + frame, row, chunk + frame * header->frameSize() + row * rowSize);
+    }
+}
+
+void generate_gabor_noise_movie(const std::string &filename, GaborNoiseMovieHeader &header, unsigned nThreads)
+{
+    if (header.bitsPerPixel != 8 && header.bitsPerPixel != 16) {
+        throw std::runtime_error("bitsPerPixel must be 8 or 16");
+    }
+    if (header.textureSize == 0 || header.nFrames == 0 || header.framesPerChunk == 0 || header.frameRate <= 0.0f) {
+        throw std::runtime_error("textureSize, nFrames, framesPerChunk and frameRate must be positive");
+    }
+    if (nThreads == 0) {
+        nThreads = std::max(1u, boost::thread::hardware_concurrency());
+    }
+
+    FILE* fp = std::fopen(filename.c_str(), "wb");
+    if (fp == NULL) {
+        throw std::runtime_error("cannot open " + filename + " for writing");
+    }
+
+    GaborNoiseRenderer renderer(header);
+    std::vector<unsigned char> page(align_to_page(sizeof(header)), 0);
+    std::fwrite(&page[0], 1, page.size(), fp); // the header is written once the hash is known
+
+    uint64_t hash = gabor_noise_movie_header_hash(header);
+    std::vector<unsigned char> chunk(header.chunkSize());
+    for (uint32_t firstFrame = 0; firstFrame < header.nFrames; firstFrame += header.framesPerChunk) {
+        uint32_t nFrames = std::min(header.framesPerChunk, header.nFrames - firstFrame);
+        std::fill(chunk.begin(), chunk.end(), 0);
+
+        boost::thread_group threads;
+        for (unsigned t = 0; t < nThreads; t++) {
+            threads.add_thread(new boost::thread(render_rows, &renderer, &header, firstFrame, nFrames, t, nThreads, &chunk[0]));
+        }
+        threads.join_all();
+
+        hash = gabor_noise_movie_hash(&chunk[0], nFrames * header.frameSize(), hash);
+        if (std::fwrite(&chunk[0], 1, chunk.size(), fp) != chunk.size()) {
+            std::fclose(fp);
+            throw std::runtime_error("cannot write to " + filename);
+        }
+    }
+
+    header.hash = hash;
+    std::rewind(fp);
+    std::fwrite(&header, sizeof(header), 1, fp);
+    if (std::fclose(fp) != 0) {
+        throw std::runtime_error("cannot write to " + filename);
+    }
+}
+
+
+// #############################################################################
+
+GaborNoiseMovieFile::GaborNoiseMovieFile(const std::string &filename) :
+    filename_(filename),
+    fd_(-1),
+    data_(NULL),
+    size_(0)
+{
+    fd_ = open(filename.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+        throw std::runtime_error("cannot open noise movie " + filename);
+    }
+
+    struct stat fileStatus;
+    if (fstat(fd_, &fileStatus) != 0 ||
+        std::size_t(fileStatus.st_size) < sizeof(header_) ||
+        pread(fd_, &header_, sizeof(header_), 0) != ssize_t(sizeof(header_)))
+    {
+        close(fd_);
+        throw std::runtime_error("cannot read the header of noise movie " + filename);
+    }
+
+    if (std::memcmp(header_.magic, GABOR_NOISE_MOVIE_MAGIC, sizeof(header_.magic)) != 0 ||
+        header_.version != GABOR_NOISE_MOVIE_VERSION ||
+        (header_.bitsPerPixel != 8 && header_.bitsPerPixel != 16) ||
+        header_.textureSize == 0 || header_.nFrames == 0 || header_.framesPerChunk == 0 || header_.frameRate <= 0.0f ||
+        std::size_t(fileStatus.st_size) < header_.fileSize())
+    {
+        close(fd_);
+        throw std::runtime_error(filename + " is not a valid noise movie");
+    }
+
+    size_ = header_.fileSize();
+    void *mapping = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd_, 0);
+    if (mapping == MAP_FAILED) {
+        close(fd_);
+        throw std::runtime_error("cannot memory-map noise movie " + filename);
+    }
+    data_ = static_cast<unsigned char *>(mapping);
+    madvise(data_, size_, MADV_SEQUENTIAL);
+}
+
+GaborNoiseMovieFile::~GaborNoiseMovieFile()
+{
+    munmap(data_, size_);
+    close(fd_);
+}
+
+void GaborNoiseMovieFile::verifyHash() const
+{
+    uint64_t hash = gabor_noise_movie_header_hash(header_);
+    for (uint32_t i = 0; i < header_.nFrames; i++) {
+        hash = gabor_noise_movie_hash(frame(i), header_.frameSize(), hash);
+    }
+    if (hash != header_.hash) {
+        throw std::runtime_error("noise movie " + filename_ + " does not match the hash in its header");
+    }
+}
+
+void GaborNoiseMovieFile::prefetch(uint32_t frame) const
+{
+    if (frame >= header_.nFrames)
+        return;
+    std::size_t chunkOffset = header_.frameOffset(frame - frame % header_.framesPerChunk);
+    madvise(data_ + chunkOffset, header_.chunkSize(), MADV_WILLNEED);
+}
+
+
+// #############################################################################
+
+GaborNoiseMovieLoader::GaborNoiseMovieLoader(const GaborNoiseMovieFile &movie) :
+    movie_(movie),
+    stop_(false)
+{
+    thread_ = boost::thread(&GaborNoiseMovieLoader::run, this);
+}
+
+GaborNoiseMovieLoader::~GaborNoiseMovieLoader()
+{
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        stop_ = true;
+    }
+    condition_.notify_all();
+    thread_.join();
+}
+
+void GaborNoiseMovieLoader::request(std::size_t slot, uint32_t frame, void *destination)
+{
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (pending_.size() <= slot) {
+            pending_.resize(slot + 1, false);
+        }
+        pending_[slot] = true;
+        Request request = { slot, frame, destination };
+        requests_.push_back(request);
+    }
+    condition_.notify_all();
+}
+
+void GaborNoiseMovieLoader::wait(std::size_t slot)
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    while (slot < pending_.size() && pending_[slot]) {
+        condition_.wait(lock);
+    }
+}
+
+void GaborNoiseMovieLoader::run()
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    while (true) {
+        while (!stop_ && requests_.empty()) {
+            condition_.wait(lock);
+        }
+        if (stop_)
+            return;
+
+        Request request = requests_.front();
+        requests_.pop_front();
+        lock.unlock();
+        std::memcpy(request.destination, movie_.frame(request.frame), movie_.header().frameSize());
+        movie_.prefetch(request.frame + movie_.header().framesPerChunk); // page in the next chunk while this one is shown
+        lock.lock();
+
+        pending_[request.slot] = false;
+        condition_.notify_all();
+    }
+}
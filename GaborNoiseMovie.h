@@ -0,0 +1,200 @@
+/*
+ *  GaborNoiseMovie.h
+ *  DynamicGaborNoise
+ *
+ *  Precomputed Gabor noise movies: the file format, the CPU renderer that writes them
+ *  and the memory-mapped reader used for playback.
+ *
+ */
+
+#ifndef GaborNoiseMovie_H_
+#define GaborNoiseMovie_H_
+
+#include <climits>
+#include <cmath>
+#include <cstddef>
+#include <deque>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#ifndef M_PI
+#  define M_PI 3.14159265358979323846
+#endif
+
+const float gabor_noise_truncate = 0.01; // the value of the Gaussian at which the noise Gabor is truncated
+
+
+// The same generator is used on the GPU path (DynamicGaborNoise::gabor_noise_begin) and by the
+// movie renderer, so that a seed gives the same noise in both.
+
+class pseudo_random_number_generator {
+private:
+    uint32_t seed_;
+public:
+    void seed(uint32_t s) { seed_ = s; }
+    uint32_t changeSeed () {seed_ *= 3039177861u; return seed_; }
+    float uniform_0_1 () {return float(changeSeed()) / float(UINT_MAX); }
+    float uniform (float min, float max) { return min + (uniform_0_1() * (max - min)); }
+    float gaussian_rv (float mean, float variance) {float x_1 = uniform_0_1(); float x_2 = uniform_0_1(); float z = sqrt(-2.0 * log(x_1)) * cos(2.0 * M_PI * x_2); return mean + (sqrt(variance) * z); } // Box-Muller transformation
+};
+
+// Noise parameters derived from the stimulus parameters, in pixels. Computed in one place for the
+// DynamicGaborNoise constructor, gabor_noise_begin and the movie renderer.
+
+struct GaborNoiseGeometry {
+    double   pixelsPerDeg;
+    float    f;        // spatial frequency, in cycles per pixel
+    float    a;        // bandwidth
+    float    r;        // radius at which a Gabor is truncated, also the grid cell size
+    float    lambda;   // impulse density
+    unsigned gridSize; // cells per side, with one extra cell on either side
+};
+
+GaborNoiseGeometry gabor_noise_geometry(float horizontalResolution, float viewingDistance, float horizontalScreenSize, unsigned textureSize,
+                                        unsigned nImpulses, float spatialFrequency, float bandWidth);
+
+// Fills impulseParams with (x, y, orientation, phase jitter) for every impulse of every grid cell,
+// in the layout of the ImpulseParam uniform block.
+void gabor_noise_impulse_params(uint32_t seed, unsigned gridSize, unsigned nImpulses, float timeSpeedUpSigma, std::vector<float> &impulseParams);
+
+
+// File layout: the header, padded to GABOR_NOISE_MOVIE_ALIGNMENT, followed by the frames. Frames are
+// textureSize x textureSize, 8 or 16 bits (native byte order) per pixel, row by row, and grouped into
+// chunks of framesPerChunk frames; every chunk starts on a GABOR_NOISE_MOVIE_ALIGNMENT boundary.
+// hash is the 64 bit FNV-1a hash of the header (with hash set to 0) followed by all frame bytes (without padding).
+
+#define GABOR_NOISE_MOVIE_MAGIC     "GBRNOISE"
+#define GABOR_NOISE_MOVIE_VERSION   1
+#define GABOR_NOISE_MOVIE_ALIGNMENT 4096
+
+struct GaborNoiseMovieHeader {
+    char     magic[8];
+    uint64_t hash;
+    uint32_t version;
+
+    // DynamicGaborNoise parameters
+    float    horizontalResolution;
+    float    verticalResolution;
+    float    viewingDistance;
+    float    horizontalScreenSize;
+    uint32_t textureSize;
+    uint32_t noise_nImpulses;
+    float    noise_spatialFrequency;
+    float    noise_bandWidth;
+    float    noise_timeSpeedUp;
+    float    noise_timeSpeedUpSigma;
+    float    noise_contrast;
+    float    azimuth;
+    float    elevation;
+    float    sigma;
+    float    orientation;
+    float    spatialFrequency;
+    float    phaseOffset;
+    float    contrast;
+    float    transparency;
+    uint32_t seed;
+
+    // Movie layout
+    float    frameRate;      // in frames per second
+    uint32_t nFrames;
+    uint32_t bitsPerPixel;   // 8 or 16
+    uint32_t framesPerChunk;
+
+    GaborNoiseMovieHeader();
+
+    std::size_t frameSize() const;
+    std::size_t chunkSize() const;
+    std::size_t frameOffset(uint32_t frame) const;
+    std::size_t fileSize() const;
+};
+
+uint64_t gabor_noise_movie_hash(const unsigned char *data, std::size_t size, uint64_t hash);
+uint64_t gabor_noise_movie_header_hash(const GaborNoiseMovieHeader &header); // hash of the header alone, the start of the movie's hash
+
+
+// Renders the noise of the detection-Gabor-free stimulus on the CPU, exactly as Dynamic_Gabor_Noise.fs does.
+
+class GaborNoiseRenderer {
+public:
+    explicit GaborNoiseRenderer(const GaborNoiseMovieHeader &header);
+
+    float intensity(float x, float y, float time) const; // in [0,1] before clamping
+    void renderRow(uint32_t frame, uint32_t row, unsigned char *pixels) const;
+    void renderFrame(uint32_t frame, unsigned char *pixels) const;
+
+private:
+    float cell(int cx, int cy, float x_c, float y_c, float time) const;
+
+    GaborNoiseMovieHeader header_;
+    GaborNoiseGeometry geometry_;
+    float scale_;
+    std::vector<float> impulseParams_;
+};
+
+// Writes a movie to filename using nThreads rendering threads (0 = one per core); fills in header.hash.
+void generate_gabor_noise_movie(const std::string &filename, GaborNoiseMovieHeader &header, unsigned nThreads);
+
+
+// Read-only memory mapping of a movie file. Opening it only reads the header; verifyHash checks the hash
+// of the header and frames against the one stored in the header (this reads the whole file).
+
+class GaborNoiseMovieFile {
+public:
+    explicit GaborNoiseMovieFile(const std::string &filename);
+    ~GaborNoiseMovieFile();
+
+    void verifyHash() const;
+    const GaborNoiseMovieHeader& header() const { return header_; }
+    const unsigned char* frame(uint32_t frame) const { return data_ + header_.frameOffset(frame); }
+    void prefetch(uint32_t frame) const; // asks the kernel to page in the chunk holding this frame
+
+private:
+    GaborNoiseMovieFile(const GaborNoiseMovieFile&);
+    GaborNoiseMovieFile& operator=(const GaborNoiseMovieFile&);
+
+    std::string filename_;
+    GaborNoiseMovieHeader header_;
+    int fd_;
+    unsigned char *data_;
+    std::size_t size_;
+};
+
+
+// Copies movie frames into caller-provided memory (mapped pixel buffers) on a worker thread, so that
+// page faults and file I/O happen off the render thread. Slots identify the destinations.
+
+class GaborNoiseMovieLoader {
+public:
+    explicit GaborNoiseMovieLoader(const GaborNoiseMovieFile &movie);
+    ~GaborNoiseMovieLoader();
+
+    void request(std::size_t slot, uint32_t frame, void *destination);
+    void wait(std::size_t slot); // blocks until the copy into this slot has finished
+
+private:
+    GaborNoiseMovieLoader(const GaborNoiseMovieLoader&);
+    GaborNoiseMovieLoader& operator=(const GaborNoiseMovieLoader&);
+
+    struct Request {
+        std::size_t slot;
+        uint32_t frame;
+        void *destination;
+    };
+
+    void run();
+
+    const GaborNoiseMovieFile &movie_;
+    boost::mutex mutex_;
+    boost::condition_variable condition_;
+    std::deque<Request> requests_;
+    std::vector<bool> pending_;
+    bool stop_;
+    boost::thread thread_;
+};
+
+
+#endif
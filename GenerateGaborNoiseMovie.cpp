@@ -0,0 +1,97 @@
+/*
+ *  GenerateGaborNoiseMovie.cpp
+ *  DynamicGaborNoise
+ *
+ *  Command line tool that renders a noise movie for the noiseMovie parameter of DynamicGaborNoise.
+ *  It does not need MWorks or OpenGL:
+ *
+ *      c++ -O3 GaborNoiseMovie.cpp GenerateGaborNoiseMovie.cpp -o GenerateGaborNoiseMovie -lboost_thread -lboost_system
+ *      ./GenerateGaborNoiseMovie output=noise.gnm seed=1234 nFrames=600 noise_nImpulses=5 ...
+ *
+ *  Every field of GaborNoiseMovieHeader can be set as name=value (same names as the stimulus parameters),
+ *  plus output= and threads= (0 = one thread per core).
+ *
+ */
+
+#include "GaborNoiseMovie.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <exception>
+#include <string>
+
+
+static bool set_header_field(GaborNoiseMovieHeader &header, const std::string &name, const char *value)
+{
+#define FLOAT_FIELD(field)    if (name == #field) { header.field = std::atof(value); return true; }
+#define UNSIGNED_FIELD(field) if (name == #field) { header.field = std::strtoul(value, NULL, 10); return true; }
+    FLOAT_FIELD(horizontalResolution)
+    FLOAT_FIELD(verticalResolution)
+    FLOAT_FIELD(viewingDistance)
+    FLOAT_FIELD(horizontalScreenSize)
+    UNSIGNED_FIELD(textureSize)
+    UNSIGNED_FIELD(noise_nImpulses)
+    FLOAT_FIELD(noise_spatialFrequency)
+    FLOAT_FIELD(noise_bandWidth)
+    FLOAT_FIELD(noise_timeSpeedUp)
+    FLOAT_FIELD(noise_timeSpeedUpSigma)
+    FLOAT_FIELD(noise_contrast)
+    FLOAT_FIELD(azimuth)
+    FLOAT_FIELD(elevation)
+    FLOAT_FIELD(sigma)
+    FLOAT_FIELD(orientation)
+    FLOAT_FIELD(spatialFrequency)
+    FLOAT_FIELD(phaseOffset)
+    FLOAT_FIELD(contrast)
+    FLOAT_FIELD(transparency)
+    UNSIGNED_FIELD(seed)
+    FLOAT_FIELD(frameRate)
+    UNSIGNED_FIELD(nFrames)
+    UNSIGNED_FIELD(bitsPerPixel)
+    UNSIGNED_FIELD(framesPerChunk)
+#undef FLOAT_FIELD
+#undef UNSIGNED_FIELD
+    return false;
+}
+
+
+int main(int argc, char *argv[])
+{
+    GaborNoiseMovieHeader header;
+    header.seed = unsigned (time(0));
+    std::string output = "noise.gnm";
+    unsigned nThreads = 0;
+
+    for (int i = 1; i < argc; i++) {
+        std::string argument(argv[i]);
+        std::size_t separator = argument.find('=');
+        if (separator == std::string::npos) {
+            std::fprintf(stderr, "%s: expected name=value, got %s\n", argv[0], argv[i]);
+            return EXIT_FAILURE;
+        }
+        std::string name = argument.substr(0, separator);
+        const char *value = argv[i] + separator + 1;
+        if (name == "output") {
+            output = value;
+        }
+        else if (name == "threads") {
+            nThreads = std::strtoul(value, NULL, 10);
+        }
+        else if (!set_header_field(header, name, value)) {
+            std::fprintf(stderr, "%s: unknown parameter %s\n", argv[0], name.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+
+    try {
+        generate_gabor_noise_movie(output, header, nThreads);
+    }
+    catch (const std::exception &e) {
+        std::fprintf(stderr, "%s: %s\n", argv[0], e.what());
+        return EXIT_FAILURE;
+    }
+
+    std::printf("%s: %u frames, seed %u, hash %016llx\n", output.c_str(), header.nFrames, header.seed, (unsigned long long)header.hash);
+    return EXIT_SUCCESS;
+}